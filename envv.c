@@ -16,14 +16,26 @@
 /*  eval `envv add PATHVAR dir [position]`                     */
 /*  eval `envv del PATHVAR dir`                                */
 /*  eval `envv move PATHVAR dir position`                      */
+/*  eval `envv require package`                                */
+/*  eval `envv addifdir PATHVAR dir [position]`                */
+/*  eval `envv setiffile ENVVAR file`                          */
+/*  eval `envv setifunset ENVVAR value`                        */
+/*  eval `envv rank PATHVAR dir priority`                      */
 /*                                                             */
 /*  Options:                                                   */
 /*   -e = don't escape shell chars                             */
 /*   -s = put trailing semicolon after each command.           */
+/*   -a = edit zsh/csh path arrays instead of full assignments */
 /*   -h = display usage information                            */
 /*                                                             */
 /*  If no commands given on command line, read from stdin      */
 /*                                                             */
+/*  If ENVV_TRACE names a file, timestamped events are         */
+/*  appended to it for profiling.  See envv-trace2json.        */
+/*                                                             */
+/*  Compiled with -DENVV_BUILTIN, there is no main(); the      */
+/*  bash and zsh builtins call RunEnvv() instead.              */
+/*                                                             */
 /***************************************************************/
 #define VERSION "1.7"
 #define _POSIX_C_SOURCE 200809L
@@ -32,16 +44,22 @@
 #define _SVID_SOURCE 1
 
 #include <ctype.h>
+#include <fcntl.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pwd.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <string.h>
 #include <strings.h>
 #include <stdlib.h>
 #include <unistd.h>
 
+#include "envv.h"
+
 /* Maximum number of components allowed in a colon-separated path list */
 
 #define MAXCOMPONENTS 256
@@ -49,11 +67,6 @@
 char *PathComp[MAXCOMPONENTS];
 int NumComponents;
 
-/* Possible types of shells */
-#define NO_SH    -1
-#define SH_LIKE  0
-#define CSH_LIKE 1
-
 /* Possible directives */
 #define NO_D  -1
 #define D_SET  0
@@ -62,29 +75,64 @@ int NumComponents;
 #define D_DEL  3
 #define D_CHOOSE 4
 #define D_LOCAL 5
+#define D_REQUIRE 6
+#define D_ADDIFDIR 7
+#define D_SETIFFILE 8
+#define D_SETIFUNSET 9
+#define D_RANK 10
 
 /* Positions */
 #define NO_P  0
 
+/* Shells whose path variables are tied to arrays */
+#define NO_ARRAYS  0
+#define ZSH_ARRAYS 1
+#define CSH_ARRAYS 2
+
 typedef struct {
    char *name;
    int type;
+   int arrays;
 } ShellType;
 
 ShellType Shells[] = {
-    { "ash",  SH_LIKE },
-    { "bash", SH_LIKE },
-    { "csh",  CSH_LIKE },
-    { "dash", SH_LIKE },
-    { "ksh",  SH_LIKE },
-    { "mksh", SH_LIKE },
-    { "rsh",  SH_LIKE },
-    { "sh",   SH_LIKE },
-    { "tcsh", CSH_LIKE },
-    { "zsh",  SH_LIKE },
-    { NULL,   NO_SH }
+    { "ash",  SH_LIKE,  NO_ARRAYS },
+    { "bash", SH_LIKE,  NO_ARRAYS },
+    { "csh",  CSH_LIKE, CSH_ARRAYS },
+    { "dash", SH_LIKE,  NO_ARRAYS },
+    { "ksh",  SH_LIKE,  NO_ARRAYS },
+    { "mksh", SH_LIKE,  NO_ARRAYS },
+    { "rsh",  SH_LIKE,  NO_ARRAYS },
+    { "sh",   SH_LIKE,  NO_ARRAYS },
+    { "tcsh", CSH_LIKE, CSH_ARRAYS },
+    { "zsh",  SH_LIKE,  ZSH_ARRAYS },
+    { NULL,   NO_SH,    NO_ARRAYS }
+};
+
+/* Path variables and the arrays they are tied to.  For these, envv
+   issues a small edit of the array rather than re-assigning the whole
+   variable, so the shell does less work re-parsing it. */
+typedef struct {
+   char *var;
+   char *array;
+   int arrays;
+} TiedArray;
+
+TiedArray TiedArrays[] = {
+    { "PATH",        "path",        ZSH_ARRAYS | CSH_ARRAYS },
+    { "MANPATH",     "manpath",     ZSH_ARRAYS },
+    { "FPATH",       "fpath",       ZSH_ARRAYS },
+    { "CDPATH",      "cdpath",      ZSH_ARRAYS },
+    { "MODULE_PATH", "module_path", ZSH_ARRAYS },
+    { NULL,          NULL,          NO_ARRAYS }
 };
 
+/* Array style of the user's shell; see FigureShellTypeFromName.
+   Array edits only work in the user's own shell, not in sh scripts
+   it runs, so they are used only if asked for with -a. */
+static int ShellArrays = NO_ARRAYS;
+static int UseArrays = 0;
+
 /* A list of all the characters which should be escaped */
 char *escape = "\\\"'!$%^&*()[]<>{}`~| ;?\t";
 static int ShouldEscape = 1;
@@ -112,8 +160,98 @@ char Val[MAX_VAL_LEN+1];
 char Pos[MAX_POS_LEN+1];
 int ArgsSupplied;
 
+/* Where directives are read from when not on the command line */
+FILE *Input;
+
+/* Packages loaded with the "require" directive.  Loaded[] is seeded
+   from ENVV_LOADED, so a package already loaded by an earlier envv
+   invocation is not applied again.  Loading[] is the chain of packages
+   currently being loaded, used to detect dependency cycles. */
+#define MAXPACKAGES 256
+#define MAX_REQUIRE_DEPTH 32
+#define LOADED_VAR "ENVV_LOADED"
+#define PACKAGE_PATH_VAR "ENVV_PATH"
+
+char *Loaded[MAXPACKAGES];
+int NumLoaded;
+int LoadedInit;
+int LoadedChanged;
+char *Loading[MAX_REQUIRE_DEPTH];
+int LoadDepth;
+
+/* Values looked up for ${VAR} expansion in directive arguments.
+   An entry is dropped as soon as envv changes the variable, so
+   expansions always see the updated environment. */
+#define MAXEXPANDCACHE 64
+
+typedef struct {
+   char *name;
+   char *val;
+} ExpandEntry;
+
+ExpandEntry ExpandCache[MAXEXPANDCACHE];
+int NumExpandCache;
+
+/* Results of stat() for the conditional directives, so each distinct
+   path is looked at only once per run. */
+#define MAXSTATCACHE 1024
+
+typedef struct {
+   char *path;
+   int exists;
+   int isdir;
+} StatEntry;
+
+StatEntry StatCache[MAXSTATCACHE];
+int NumStatCache;
+
+/* Number of bytes of shell commands written to stdout */
+long BytesEmitted;
+
+/* Trace file named by ENVV_TRACE, or -1 if not tracing.  Every event
+   is a single write() to a file opened with O_APPEND, so events from
+   many envv processes interleave without being torn. */
+#define TRACE_VAR "ENVV_TRACE"
+#define MAX_TRACE_LEN 1024
+
+int TraceFd = -1;
+
+/* Path variables with ranked components.  Each one's priorities are
+   kept in a companion variable, ENVV_RANK_<var>, as a colon-separated
+   list of priority=dir.  The variable is sorted once, just before it
+   is emitted at the end of the run. */
+#define RANK_PREFIX "ENVV_RANK_"
+#define MAXRANKED 32
+
+typedef struct {
+   char *dir;
+   int prio;
+   int index;
+} RankEntry;
+
+char *Ranked[MAXRANKED];
+int NumRanked;
+
+/* Variables changed while loading a package.  Their commands are held
+   back until the whole package and its dependencies are loaded, so
+   each one is issued once with its final value. */
+#define MAXPENDING 256
+
+typedef struct {
+   char *var;
+   int local;
+} PendingEntry;
+
+PendingEntry Pending[MAXPENDING];
+int NumPending;
+
+/* Set by the shell builtins; NULL when running as a program */
+EnvvHooks *ShellHooks = NULL;
+
 /* Function Prototypes */
-void Init (int argc, char *argv[]);
+int Init (int argc, char *argv[]);
+void ResetState (void);
+char *GetVar (const char *var);
 int FigureShellTypeFromName (char *s);
 int GetShellType (void);
 void DoSetenv (const char *var, const char *val, int shell, int local);
@@ -125,11 +263,69 @@ int SplitPath (char *path);
 int FindCurPos (const char *dir);
 void PrintEscaped (const char *s, int colon);
 void PathManip (const char *var, const char *dir, int shell, int pos, int what);
+char *TiedArrayName (const char *var);
+void EmitArrayInsert (const char *array, const char *dir, int at, int n);
+void EmitArrayRemove (const char *array, int at, int n);
 void Usage (const char *name);
 int ComparePathElements (const char *p1, const char *p2);
 int GetCommand (void);
 int ReadEscapedToken (char *buf, int len, int eoln_flag);
 int ReadCmdFromStdin (void);
+int FromCmdLine (void);
+int DoDirective (int shell);
+int LoadPackage (const char *name, int shell);
+int DeferVar (const char *var, int local);
+void FlushPending (int shell);
+char *FindPackage (const char *name);
+int IsLoaded (const char *name);
+void MarkLoaded (const char *name);
+void InitLoaded (void);
+void EmitLoaded (int shell);
+char *CachedGetenv (const char *var);
+void ForgetCachedVar (const char *var);
+void ExpandVars (char *buf, int len);
+void ExpandArgs (void);
+StatEntry *CachedStat (const char *path);
+void StoreVar (const char *var, const char *val);
+char *RankVarName (const char *var);
+void DoRank (const char *var, const char *dir, int prio);
+int IsRanked (const char *var);
+void EmitRanked (int shell);
+void SortRanked (const char *var, int shell);
+char *NormalizeDir (const char *dir);
+int CompareRankDir (const void *a, const void *b);
+int CompareRankPrio (const void *a, const void *b);
+void Emit (const char *fmt, ...);
+void EmitChar (int c);
+long long TraceNow (void);
+void Trace (long long ts, const char *fmt, ...);
+void InitTrace (void);
+char *TraceEscape (const char *s, char *buf, int len);
+void TraceExit (void);
+
+/***************************************************************/
+/*                                                             */
+/*  Emit, EmitChar                                             */
+/*                                                             */
+/*  Write shell commands to stdout, counting the bytes.        */
+/*                                                             */
+/***************************************************************/
+void Emit(const char *fmt, ...)
+{
+   va_list ap;
+   int n;
+
+   va_start(ap, fmt);
+   n = vprintf(fmt, ap);
+   va_end(ap);
+   if (n > 0) BytesEmitted += n;
+}
+
+void EmitChar(int c)
+{
+   putchar(c);
+   BytesEmitted++;
+}
 
 /***************************************************************/
 /*                                                             */
@@ -150,12 +346,12 @@ void PrintEscaped(const char *s, int colon)
    if (!s || !*s) return;
 
    if (colon) {
-      if (internal_flag) putchar(':');
+      if (internal_flag) EmitChar(':');
       else internal_flag = 1;
    }
    while (*s) {
-      if (ShouldEscape && strchr(escape, *s)) putchar('\\');
-      putchar(*s);
+      if (ShouldEscape && strchr(escape, *s)) EmitChar('\\');
+      EmitChar(*s);
       s++;
    }
 }
@@ -174,7 +370,7 @@ int GetShellType(void)
    int type;
    struct passwd *pw;
 
-   s = getenv("SHELL");
+   s = GetVar("SHELL");
 
    type = FigureShellTypeFromName(s);
    if (type != NO_SH) return type;
@@ -192,7 +388,7 @@ int GetShellType(void)
 /*  FigureShellTypeFromName                                    */
 /*                                                             */
 /*  Given the name of a shell, figure out if it's like sh or   */
-/*  csh.                                                       */
+/*  csh.  Also note whether it has tied path arrays.           */
 /*                                                             */
 /***************************************************************/
 int FigureShellTypeFromName(char *s)
@@ -207,8 +403,12 @@ int FigureShellTypeFromName(char *s)
      if (*s == '/') t=s+1;
 
    /* Figure out the type of shell */
-   for (i=0; Shells[i].name; i++)
-     if (!strcmp(t, Shells[i].name)) return Shells[i].type;
+   for (i=0; Shells[i].name; i++) {
+      if (!strcmp(t, Shells[i].name)) {
+	 ShellArrays = Shells[i].arrays;
+	 return Shells[i].type;
+      }
+   }
 
    /* Didn't match anything */
    return NO_SH;
@@ -252,64 +452,189 @@ int ComparePathElements(const char *p1, const char *p2)
 /***************************************************************/
 /***************************************************************/
 /***************************************************************/
+#ifndef ENVV_BUILTIN
 int main(int argc, char *argv[])
 {
-   int what;
-   int pos;
+   return RunEnvv(argc, argv);
+}
+#endif
+
+/***************************************************************/
+/*                                                             */
+/*  RunEnvv                                                    */
+/*                                                             */
+/*  Process all the directives for one invocation of envv.     */
+/*  Returns the exit status.                                   */
+/*                                                             */
+/***************************************************************/
+int RunEnvv(int argc, char *argv[])
+{
    int shell;
+   int status = 0;
+   int r;
+   char tshell[MAX_TRACE_LEN/4];
+
+   if (Init(argc, argv)) return 1;
 
-   Init(argc, argv);
+   if (ShellHooks) shell = ShellHooks->shell;
+   else shell = GetShellType();
+   if (TraceFd >= 0)
+      Trace(TraceNow(), "shell\t%s\t%s",
+	    (shell == SH_LIKE) ? "sh" : (shell == CSH_LIKE) ? "csh" : "unknown",
+	    TraceEscape(GetVar("SHELL"), tshell, sizeof(tshell)));
 
-   shell = GetShellType();
    if (shell == NO_SH) {
       fprintf(stderr, "%s: Can't figure out shell type!\n", argv[0]);
-      return 1;
-   }
-
-   while(1) {
-      what = NO_D;
-      pos = NO_P;
-      if (!GetCommand()) return 0;
-      if (ArgsSupplied < 3) {
-	 if (UseCmdLine) {
+      status = 1;
+   } else {
+      while(GetCommand()) {
+	 r = DoDirective(shell);
+	 if (r > 0 && UseCmdLine) {
 	    Usage(Argv[0]);
-	    return 1;
-	 } else {
-	    fprintf(stderr, "%s: not enough arguments in command\n", Argv[0]);
+	    status = 1;
+	    break;
 	 }
-	 continue;
+	 if (r < 0) status = 1;
       }
-      if      (!strcasecmp(Directive, "set"))    what = D_SET;
-      else if (!strcasecmp(Directive, "add"))    what = D_ADD;
-      else if (!strcasecmp(Directive, "del"))    what = D_DEL;
-      else if (!strcasecmp(Directive, "move"))   what = D_MOVE;
-      else if (!strcasecmp(Directive, "choose")) what = D_CHOOSE;
-      else if (!strcasecmp(Directive, "local"))  what = D_LOCAL;
 
-      if (what == NO_D) {
-	 if (UseCmdLine) {
-	    Usage(argv[0]);
-	    return 1;
-	 } else {
-	    fprintf(stderr, "%s: unknown directive %s\n", Argv[0], Directive);
-	    continue;
-	 }
-      }
+      /* Put ranked paths in order, and record any newly-required
+	 packages, in a single command each.  This is done even after
+	 an error, since what was applied must still be issued. */
+      EmitRanked(shell);
+      EmitLoaded(shell);
+   }
 
-      if (ArgsSupplied >= 4) pos = atoi(Pos);
+   /* A builtin may be run again, so leave stdin usable */
+   if (!UseCmdLine) clearerr(stdin);
+   fflush(stdout);
+   TraceExit();
+   return status;
+}
 
-      switch(what) {
-       case D_SET:  DoSetenv(Var, Val, shell, 0); break;
-       case D_LOCAL: DoSetenv(Var, Val, shell, 1); break;
-       case D_CHOOSE: DoChoose(Var, Val, shell); break;
-       case D_ADD:
-       case D_DEL:
-       case D_MOVE: PathManip(Var, Val, shell, pos, what); break;
-       default: fprintf(stderr, "%s: internal error - unknown directive %d\n",
-			Argv[0], what);
+/***************************************************************/
+/*                                                             */
+/*  GetVar                                                     */
+/*                                                             */
+/*  Get the value of a variable from the environment, or from  */
+/*  the shell if we are running as a builtin.                  */
+/*                                                             */
+/***************************************************************/
+char *GetVar(const char *var)
+{
+   if (ShellHooks) return ShellHooks->getvar(var);
+   return getenv(var);
+}
+
+/***************************************************************/
+/*                                                             */
+/*  FromCmdLine                                                */
+/*                                                             */
+/*  Return 1 if the current directive came from the command    */
+/*  line, 0 if it came from stdin or a package file.           */
+/*                                                             */
+/***************************************************************/
+int FromCmdLine(void)
+{
+   return (UseCmdLine && !LoadDepth);
+}
+
+/***************************************************************/
+/*                                                             */
+/*  DoDirective                                                */
+/*                                                             */
+/*  Carry out the directive in Directive/Var/Val/Pos.  Return  */
+/*  0 for success, 1 if the directive is malformed, or -1 if   */
+/*  it failed (a package couldn't be loaded.)                  */
+/*                                                             */
+/***************************************************************/
+int DoDirective(int shell)
+{
+   int what = NO_D;
+   int pos = NO_P;
+   int minargs = 3;
+   int status = 0;
+   char *end;
+   long long start = 0;
+   char tdir[MAX_TRACE_LEN/4], tvar[MAX_TRACE_LEN/4];
+
+   if (TraceFd >= 0) start = TraceNow();
+
+   ExpandArgs();
+
+   /* "require" reads over Directive and Var, so keep them for the trace */
+   if (TraceFd >= 0) {
+      TraceEscape(Directive, tdir, sizeof(tdir));
+      TraceEscape((ArgsSupplied >= 2) ? Var : "", tvar, sizeof(tvar));
+   }
+
+   if      (!strcasecmp(Directive, "set"))     what = D_SET;
+   else if (!strcasecmp(Directive, "add"))     what = D_ADD;
+   else if (!strcasecmp(Directive, "del"))     what = D_DEL;
+   else if (!strcasecmp(Directive, "move"))    what = D_MOVE;
+   else if (!strcasecmp(Directive, "choose"))  what = D_CHOOSE;
+   else if (!strcasecmp(Directive, "local"))   what = D_LOCAL;
+   else if (!strcasecmp(Directive, "require")) what = D_REQUIRE;
+   else if (!strcasecmp(Directive, "addifdir"))   what = D_ADDIFDIR;
+   else if (!strcasecmp(Directive, "setiffile"))  what = D_SETIFFILE;
+   else if (!strcasecmp(Directive, "setifunset")) what = D_SETIFUNSET;
+   else if (!strcasecmp(Directive, "rank"))       what = D_RANK;
+
+   if (what == D_REQUIRE) minargs = 2;
+   if (what == D_RANK) minargs = 4;
+
+   if (ArgsSupplied < minargs) {
+      if (!FromCmdLine())
+	 fprintf(stderr, "%s: not enough arguments in command\n", Argv[0]);
+      return 1;
+   }
+
+   if (what == NO_D) {
+      if (!FromCmdLine())
+	 fprintf(stderr, "%s: unknown directive %s\n", Argv[0], Directive);
+      return 1;
+   }
+
+   if (ArgsSupplied >= 4) pos = atoi(Pos);
+
+   /* A priority has no sensible default, so insist on a number */
+   if (what == D_RANK) {
+      pos = (int) strtol(Pos, &end, 10);
+      if (!*Pos || *end) {
+	 if (!FromCmdLine())
+	    fprintf(stderr, "%s: bad priority %s\n", Argv[0], Pos);
+	 return 1;
       }
    }
-   return 0;
+
+   switch(what) {
+    case D_SET:  DoSetenv(Var, Val, shell, 0); break;
+    case D_LOCAL: DoSetenv(Var, Val, shell, 1); break;
+    case D_CHOOSE: DoChoose(Var, Val, shell); break;
+    case D_REQUIRE:
+      status = LoadPackage(Var, shell);
+      if (!LoadDepth) FlushPending(shell);
+      break;
+    case D_ADDIFDIR:
+      if (CachedStat(Val)->isdir) PathManip(Var, Val, shell, pos, D_ADD);
+      break;
+    case D_SETIFFILE:
+      if (CachedStat(Val)->exists) DoSetenv(Var, Val, shell, 0);
+      break;
+    case D_SETIFUNSET:
+      if (!GetVar(Var)) DoSetenv(Var, Val, shell, 0);
+      break;
+    case D_RANK: DoRank(Var, Val, pos); break;
+    case D_ADD:
+    case D_DEL:
+    case D_MOVE: PathManip(Var, Val, shell, pos, what); break;
+    default: fprintf(stderr, "%s: internal error - unknown directive %d\n",
+		     Argv[0], what);
+   }
+
+   if (TraceFd >= 0)
+      Trace(start, "directive\t%lld\t%s\t%s", TraceNow() - start,
+	    tdir, tvar);
+   return status;
 }
 
 /***************************************************************/
@@ -322,25 +647,36 @@ int main(int argc, char *argv[])
 /***************************************************************/
 void DoSetenv(const char *var, const char *val, int shell, int local)
 {
-   char *envstr;
+   /* As a builtin, just set the shell variable */
+   if (ShellHooks) {
+      ShellHooks->setvar(var, val, local);
+      ForgetCachedVar(var);
+      return;
+   }
+
+   /* Inside a package, hold the command back until it is loaded */
+   if (LoadDepth && DeferVar(var, local)) {
+      StoreVar(var, val);
+      return;
+   }
 
    switch(shell) {
     case SH_LIKE:
-      printf("%s=", var);
+      Emit("%s=", var);
       PrintEscaped(val, 0);
       if (!local)
-	printf("; export %s", var);
-      printf(TrailingSemi);
+	Emit("; export %s", var);
+      Emit(TrailingSemi);
       break;
 
     case CSH_LIKE:
       if (!local)
-	printf("setenv %s ", var);
+	Emit("setenv %s ", var);
       else
-	printf("set %s=", var);
+	Emit("set %s=", var);
 
       PrintEscaped(val, 0);
-      printf(TrailingSemi);
+      Emit(TrailingSemi);
       break;
 
     default:
@@ -348,18 +684,181 @@ void DoSetenv(const char *var, const char *val, int shell, int local)
    }
 
    /* If not reading from cmd line, set the value in the environment */
-   if (!UseCmdLine) {
+   if (!FromCmdLine()) StoreVar(var, val);
+
+   return;
+}
+
+/***************************************************************/
+/*                                                             */
+/*  StoreVar                                                   */
+/*                                                             */
+/*  Set a variable in envv's environment (or the shell's, for  */
+/*  a builtin) without issuing any command.                    */
+/*                                                             */
+/***************************************************************/
+void StoreVar(const char *var, const char *val)
+{
+   char *envstr;
+
+   if (ShellHooks) {
+      ShellHooks->setvar(var, val, 0);
+   } else {
       envstr = malloc(strlen(var)+strlen(val)+2);
-      if (envstr) {
-	 sprintf(envstr, "%s=%s", var, val);
-	 putenv(envstr);
+      if (!envstr) {
+	 fprintf(stderr, "%s: out of memory!\n", Argv[0]);
+	 exit(1);
+      }
+      sprintf(envstr, "%s=%s", var, val);
+      putenv(envstr);
+   }
+   ForgetCachedVar(var);
+}
+
+/***************************************************************/
+/*                                                             */
+/*  CachedGetenv                                               */
+/*                                                             */
+/*  Like getenv, but remembers the result until the variable  */
+/*  is changed by envv.                                        */
+/*                                                             */
+/***************************************************************/
+char *CachedGetenv(const char *var)
+{
+   int i;
+   char *val;
+
+   for (i=0; i<NumExpandCache; i++)
+     if (!strcmp(var, ExpandCache[i].name)) return ExpandCache[i].val;
+
+   val = GetVar(var);
+   if (NumExpandCache < MAXEXPANDCACHE) {
+      ExpandCache[NumExpandCache].name = strdup(var);
+      if (ExpandCache[NumExpandCache].name) {
+	 ExpandCache[NumExpandCache].val = val;
+	 NumExpandCache++;
+      }
+   }
+   return val;
+}
+
+/***************************************************************/
+/*                                                             */
+/*  ForgetCachedVar                                            */
+/*                                                             */
+/*  Drop a variable from the expansion cache because its value */
+/*  has changed.                                               */
+/*                                                             */
+/***************************************************************/
+void ForgetCachedVar(const char *var)
+{
+   int i;
+
+   for (i=0; i<NumExpandCache; i++) {
+      if (!strcmp(var, ExpandCache[i].name)) {
+	 free(ExpandCache[i].name);
+	 ExpandCache[i] = ExpandCache[--NumExpandCache];
+	 return;
+      }
+   }
+}
+
+/***************************************************************/
+/*                                                             */
+/*  ExpandVars                                                 */
+/*                                                             */
+/*  Replace each ${VAR} in buf with the value of VAR in envv's */
+/*  environment.  Unset variables expand to nothing, and $${   */
+/*  yields a literal ${.  The result is truncated to len chars */
+/*                                                             */
+/***************************************************************/
+void ExpandVars(char *buf, int len)
+{
+   char out[MAX_VAL_LEN+1];
+   char name[MAX_VAR_LEN+1];
+   char *s, *e, *val;
+   int n, l;
+
+   /* Nothing to do -- the usual case */
+   if (!strchr(buf, '$')) return;
+
+   if (len > MAX_VAL_LEN) len = MAX_VAL_LEN;
+   n = 0;
+   s = buf;
+   while (*s && n < len) {
+      if (s[0] == '$' && s[1] == '$' && s[2] == '{') {
+	 /* Escaped -- copy "${" literally */
+	 out[n++] = '$';
+	 if (n < len) out[n++] = '{';
+	 s += 3;
+      } else if (s[0] == '$' && s[1] == '{' && (e = strchr(s+2, '}'))) {
+	 l = e - (s+2);
+	 if (l > MAX_VAR_LEN) l = MAX_VAR_LEN;
+	 memcpy(name, s+2, l);
+	 name[l] = 0;
+	 val = CachedGetenv(name);
+	 while (val && *val && n < len) out[n++] = *val++;
+	 s = e+1;
       } else {
+	 out[n++] = *s++;
+      }
+   }
+   out[n] = 0;
+   strcpy(buf, out);
+}
+
+/***************************************************************/
+/*                                                             */
+/*  ExpandArgs                                                 */
+/*                                                             */
+/*  Expand variables in the arguments of the current directive */
+/*                                                             */
+/***************************************************************/
+void ExpandArgs(void)
+{
+   if (ArgsSupplied >= 2) ExpandVars(Var, MAX_VAR_LEN);
+   if (ArgsSupplied >= 3) ExpandVars(Val, MAX_VAL_LEN);
+   if (ArgsSupplied >= 4) ExpandVars(Pos, MAX_POS_LEN);
+}
+
+/***************************************************************/
+/*                                                             */
+/*  CachedStat                                                 */
+/*                                                             */
+/*  Find out whether a path exists and whether it is a         */
+/*  directory, calling stat() at most once per distinct path.  */
+/*                                                             */
+/***************************************************************/
+StatEntry *CachedStat(const char *path)
+{
+   static StatEntry scratch;
+   StatEntry *e;
+   struct stat sb;
+   int i;
+
+   for (i=0; i<NumStatCache; i++)
+     if (!strcmp(path, StatCache[i].path)) return &StatCache[i];
+
+   /* Cache full?  Then just don't remember this one. */
+   e = &scratch;
+   if (NumStatCache < MAXSTATCACHE) {
+      e = &StatCache[NumStatCache];
+      e->path = strdup(path);
+      if (!e->path) {
 	 fprintf(stderr, "%s: out of memory!\n", Argv[0]);
 	 exit(1);
       }
+      NumStatCache++;
    }
-      
-   return;
+
+   if (stat(path, &sb)) {
+      e->exists = 0;
+      e->isdir = 0;
+   } else {
+      e->exists = 1;
+      e->isdir = S_ISDIR(sb.st_mode) ? 1 : 0;
+   }
+   return e;
 }
 
 /***************************************************************/
@@ -428,9 +927,21 @@ void PathManip(const char *var, const char *dir, int shell, int pos, int what)
    char *s;
    int oldpathlen;
    int newpathlen;
+   char *array;
+   int at;
 
    /* Get current value of var */
-   path = getenv(var);
+   path = GetVar(var);
+
+   /* Can we edit a tied array instead?  Only if the shell's array
+      holds exactly the components we are about to split out.  It
+      doesn't if "rank" has changed var without issuing anything, or
+      if we are inside a package, whose changes are issued later. */
+   array = NULL;
+   if (!ShellHooks && UseArrays && !LoadDepth && path && *path &&
+       *path != ':' && path[strlen(path)-1] != ':' && !strstr(path, "::") &&
+       !IsRanked(var))
+      array = TiedArrayName(var);
 
    if(path) {
       oldpathlen = strlen(path);
@@ -478,32 +989,15 @@ void PathManip(const char *var, const char *dir, int shell, int pos, int what)
       pos = curpos;
    }
 
-   /* If we are taking input from stdin, we must modify our environment
-      to reflect the updated path, so that multiple ADD, DEL, etc.
-      commands work properly.  If we don't do this, only the last
-      path manipulation command has any effect, since PathManip re-reads
-      the value from the environment each time it is called. */
-
-   if (!UseCmdLine) {
-      /* Max. length is: Length of var name + '=' + oldpath + ':' + component + ':'
-	 + '\0' */
-      newpathlen = oldpathlen + 4 + strlen(var) + strlen(dir);
-      envstr = (char *) malloc(newpathlen);
-      if (!envstr) {
-	 fprintf(stderr, "%s: out of memory!\n", Argv[0]);
-	 exit(1);
-      }
-      sprintf(envstr, "%s=", var);
-      s = envstr + strlen(envstr);
-   }
-   /* Print the path components */
-   switch(shell) {
-    case SH_LIKE: printf("%s=", var); break;
-    case CSH_LIKE: printf("setenv %s ", var); break;
+   /* Build the new value of the path.  Max. length is: Length of var
+      name + '=' + oldpath + ':' + component + ':' + '\0' */
+   newpathlen = oldpathlen + 4 + strlen(var) + strlen(dir);
+   envstr = (char *) malloc(newpathlen);
+   if (!envstr) {
+      fprintf(stderr, "%s: out of memory!\n", Argv[0]);
+      exit(1);
    }
-
-   /* Reset colon flag */
-   PrintEscaped(NULL, 0);
+   s = envstr;
 
    /* Do it! */
    for (i=0; i<NumComponents; i++) {
@@ -511,124 +1005,903 @@ void PathManip(const char *var, const char *dir, int shell, int pos, int what)
       switch(what) {
        case D_DEL:
 	 if (curpos != j) {
-	    PrintEscaped(PathComp[i],1);
-	    if (!UseCmdLine) {
-	       sprintf(s, "%s:", PathComp[i]);
-	       s += strlen(s);
-	    }
+	    sprintf(s, "%s:", PathComp[i]);
+	    s += strlen(s);
 	 }
 	 break;
 
        case D_MOVE:
 	 if (pos < curpos) {
 	    if (pos == j) {
-	       PrintEscaped(dir, 1);
-	       if (!UseCmdLine) {
-		  sprintf(s, "%s:", dir);
-		  s += strlen(s);
-	       }
+	       sprintf(s, "%s:", dir);
+	       s += strlen(s);
 	    }
 	    if (j != curpos) {
-	       PrintEscaped(PathComp[i],1);
-	       if (!UseCmdLine) {
-		  sprintf(s, "%s:", PathComp[i]);
-		  s += strlen(s);
-	       }
+	       sprintf(s, "%s:", PathComp[i]);
+	       s += strlen(s);
 	    }
          } else {
 	    if (j != curpos) {
-	       PrintEscaped(PathComp[i],1);
-	       if (!UseCmdLine) {
-		  sprintf(s, "%s:", PathComp[i]);
-		  s += strlen(s);
-	       }
+	       sprintf(s, "%s:", PathComp[i]);
+	       s += strlen(s);
 	    }
 	    if (pos == j) {
-	       PrintEscaped(dir, 1);
-	       if (!UseCmdLine) {
-		  sprintf(s, "%s:", dir);
-		  s += strlen(s);
-	       }
+	       sprintf(s, "%s:", dir);
+	       s += strlen(s);
 	    }
 	 }
 	 break;
 
        case D_ADD:
 	 if (pos == j) {
-	    PrintEscaped(dir, 1);
-	    if (!UseCmdLine) {
-	       sprintf(s, "%s:", dir);
-	       s += strlen(s);
-	    }
-	 }
-	 PrintEscaped(PathComp[i], 1);
-	 if (!UseCmdLine) {
-	    sprintf(s, "%s:", PathComp[i]);
+	    sprintf(s, "%s:", dir);
 	    s += strlen(s);
 	 }
+	 sprintf(s, "%s:", PathComp[i]);
+	 s += strlen(s);
       }
    }
 
    /* Check ADD with no pos, or pos out of range */
    if ((what == D_ADD || what == D_MOVE) && (pos < 1 || pos > NumComponents)) {
-      PrintEscaped(dir, 1);
-      if (!UseCmdLine) {
-	 sprintf(s, "%s:", dir);
-	 s += strlen(s);
-      }
+      sprintf(s, "%s:", dir);
+      s += strlen(s);
    }
 
-   /* If reading from a file, chew off the final colon in the new path
-      and put it in environment. */
-   if (!UseCmdLine) {
-      *--s = 0;
-      putenv(envstr);
-   }
+   /* Chew off the final colon */
+   if (s > envstr) s--;
+   *s = 0;
+
+   /* Issue the command.  If we are taking input from stdin, this also
+      modifies our environment to reflect the updated path, so that
+      multiple ADD, DEL, etc. commands work properly.  If we didn't do
+      this, only the last path manipulation command would have any
+      effect, since PathManip re-reads the value each time. */
+   if (array && NumComponents < MAXCOMPONENTS) {
+      /* Where the dir ends up, counting from 1 */
+      if (pos >= 1 && pos <= NumComponents) at = pos;
+      else if (what == D_MOVE) at = NumComponents;
+      else at = NumComponents + 1;
 
+      switch(what) {
+       case D_ADD:
+	 EmitArrayInsert(array, dir, at, NumComponents);
+	 break;
 
-   switch(shell) {
-    case SH_LIKE: printf("; export %s%s", var, TrailingSemi); break;
-    case CSH_LIKE: printf(TrailingSemi); break;
+       case D_DEL:
+	 EmitArrayRemove(array, curpos, NumComponents);
+	 break;
+
+       case D_MOVE:
+	 EmitArrayRemove(array, curpos, NumComponents);
+	 EmitArrayInsert(array, dir, at, NumComponents - 1);
+	 break;
+      }
+      if (!FromCmdLine()) StoreVar(var, envstr);
+   } else {
+      DoSetenv(var, envstr, shell, 0);
    }
+
+   free(envstr);
    free(path);
    return;
 }
 
 /***************************************************************/
 /*                                                             */
-/*  DoChoose                                                   */
+/*  TiedArrayName                                              */
 /*                                                             */
-/*  Simple-minded:  If shell is 0, print val1, else print val2 */
+/*  Return the name of the user's shell's array tied to var,   */
+/*  or NULL if there isn't one.                                */
 /*                                                             */
 /***************************************************************/
-void DoChoose(const char *val1, const char *val2, int shell)
+char *TiedArrayName(const char *var)
 {
-   switch(shell) {
-      case SH_LIKE:
-         PrintEscaped(val1, 0);
-	 printf(TrailingSemi);
-	 break;
+   int i;
 
-     case CSH_LIKE:
-	 PrintEscaped(val2, 0);
-	 printf(TrailingSemi);
-	 break;
+   for (i=0; TiedArrays[i].var; i++)
+     if ((TiedArrays[i].arrays & ShellArrays) &&
+	 !strcmp(var, TiedArrays[i].var)) return TiedArrays[i].array;
 
-     default:
-	 fprintf(stderr, "%s: DoChoose - bad value for shell %d\n", Argv[0], shell);
-	 break;
-   }
+   return NULL;
 }
 
-
 /***************************************************************/
 /*                                                             */
-/*  Usage - print usage instructions                           */
+/*  EmitArrayInsert                                            */
+/*                                                             */
+/*  Issue the command to insert dir so that it becomes element */
+/*  'at' (from 1) of an array which has n elements.            */
 /*                                                             */
 /***************************************************************/
-void Usage(const char *name)
+void EmitArrayInsert(const char *array, const char *dir, int at, int n)
 {
-   fprintf(stderr, "%s (version %s) Copyright 1994-2011 by Roaring Penguin Software Inc.\n\n",
+   if (ShellArrays == ZSH_ARRAYS) {
+      if (at > n) Emit("%s+=(", array);
+      else Emit("%s[%d,%d]=(", array, at, at-1);
+      PrintEscaped(dir, 0);
+      Emit(")%s", TrailingSemi);
+      return;
+   }
+
+   /* csh */
+   Emit("set %s = ( ", array);
+   if (at > n) Emit("$%s:q ", array);
+   else if (at > 1) Emit("$%s[1-%d]:q ", array, at-1);
+   PrintEscaped(dir, 0);
+   if (at == 1 && n > 0) Emit(" $%s:q", array);
+   else if (at <= n) Emit(" $%s[%d-]:q", array, at);
+   Emit(" )%s", TrailingSemi);
+}
+
+/***************************************************************/
+/*                                                             */
+/*  EmitArrayRemove                                            */
+/*                                                             */
+/*  Issue the command to remove element 'at' (from 1) of an    */
+/*  array which has n elements.                                */
+/*                                                             */
+/***************************************************************/
+void EmitArrayRemove(const char *array, int at, int n)
+{
+   if (ShellArrays == ZSH_ARRAYS) {
+      Emit("%s[%d]=()%s", array, at, TrailingSemi);
+      return;
+   }
+
+   /* csh */
+   Emit("set %s = (", array);
+   if (at > 1) Emit(" $%s[1-%d]:q", array, at-1);
+   if (at < n) Emit(" $%s[%d-]:q", array, at+1);
+   Emit(" )%s", TrailingSemi);
+}
+
+/***************************************************************/
+/*                                                             */
+/*  RankVarName                                                */
+/*                                                             */
+/*  Return the name of the variable holding var's priorities.  */
+/*                                                             */
+/***************************************************************/
+char *RankVarName(const char *var)
+{
+   char *name;
+
+   name = malloc(strlen(RANK_PREFIX) + strlen(var) + 1);
+   if (!name) {
+      fprintf(stderr, "%s: out of memory!\n", Argv[0]);
+      exit(1);
+   }
+   sprintf(name, "%s%s", RANK_PREFIX, var);
+   return name;
+}
+
+/***************************************************************/
+/*                                                             */
+/*  DoRank                                                     */
+/*                                                             */
+/*  Give a path component a priority, adding it to the path if */
+/*  necessary.  Nothing is issued until EmitRanked.            */
+/*                                                             */
+/***************************************************************/
+void DoRank(const char *var, const char *dir, int prio)
+{
+   char *rankvar, *meta, *newval, *s, *t, *e;
+
+   /* Replace any old priority for dir */
+   rankvar = RankVarName(var);
+   meta = GetVar(rankvar);
+   newval = malloc((meta ? strlen(meta) : 0) + strlen(dir) + 24);
+   if (!newval) {
+      fprintf(stderr, "%s: out of memory!\n", Argv[0]);
+      exit(1);
+   }
+   s = newval;
+   if (meta) {
+      while (*meta) {
+	 t = strchr(meta, ':');
+	 if (!t) t = meta + strlen(meta);
+	 e = strchr(meta, '=');
+	 if (e && e < t) {
+	    /* Compare dir against just the directory part of the entry */
+	    memcpy(s, e+1, t-e-1);
+	    s[t-e-1] = 0;
+	    if (ComparePathElements(dir, s)) {
+	       memcpy(s, meta, t-meta);
+	       s += t-meta;
+	       *s++ = ':';
+	    }
+	 }
+	 meta = *t ? t+1 : t;
+      }
+   }
+   sprintf(s, "%d=%s", prio, dir);
+   StoreVar(rankvar, newval);
+   free(newval);
+   free(rankvar);
+
+   /* Make sure dir is on the path; EmitRanked puts it in its place */
+   s = GetVar(var);
+   if (s) {
+      s = strdup(s);
+      if (!s) {
+	 fprintf(stderr, "%s: out of memory!\n", Argv[0]);
+	 exit(1);
+      }
+   }
+   (void) SplitPath(s);
+   if (FindCurPos(dir) == NO_P) {
+      t = GetVar(var);
+      newval = malloc((t ? strlen(t) : 0) + strlen(dir) + 2);
+      if (!newval) {
+	 fprintf(stderr, "%s: out of memory!\n", Argv[0]);
+	 exit(1);
+      }
+      if (t && *t) sprintf(newval, "%s:%s", t, dir);
+      else strcpy(newval, dir);
+      StoreVar(var, newval);
+      free(newval);
+   }
+   free(s);
+
+   /* Remember to sort var */
+   if (IsRanked(var)) return;
+   if (NumRanked == MAXRANKED) {
+      fprintf(stderr, "%s: too many ranked variables\n", Argv[0]);
+      return;
+   }
+   Ranked[NumRanked] = strdup(var);
+   if (!Ranked[NumRanked]) {
+      fprintf(stderr, "%s: out of memory!\n", Argv[0]);
+      exit(1);
+   }
+   NumRanked++;
+}
+
+/***************************************************************/
+/*                                                             */
+/*  IsRanked                                                   */
+/*                                                             */
+/*  Return 1 if var has been given a "rank" directive in this  */
+/*  run, and so is waiting to be sorted and issued.            */
+/*                                                             */
+/***************************************************************/
+int IsRanked(const char *var)
+{
+   int i;
+
+   for (i=0; i<NumRanked; i++)
+     if (!strcmp(var, Ranked[i])) return 1;
+
+   return 0;
+}
+
+/***************************************************************/
+/*                                                             */
+/*  NormalizeDir                                               */
+/*                                                             */
+/*  Return a malloc'd copy of dir without trailing slashes, so */
+/*  that strcmp agrees with ComparePathElements.               */
+/*                                                             */
+/***************************************************************/
+char *NormalizeDir(const char *dir)
+{
+   char *s;
+   int len;
+
+   s = strdup(dir);
+   if (!s) {
+      fprintf(stderr, "%s: out of memory!\n", Argv[0]);
+      exit(1);
+   }
+   len = strlen(s);
+   while (len > 1 && s[len-1] == '/') s[--len] = 0;
+   return s;
+}
+
+/***************************************************************/
+/*                                                             */
+/*  CompareRankDir, CompareRankPrio                            */
+/*                                                             */
+/*  qsort comparison functions.  CompareRankPrio puts higher   */
+/*  priorities first, and breaks ties by original position so  */
+/*  that the sort is stable.                                   */
+/*                                                             */
+/***************************************************************/
+int CompareRankDir(const void *a, const void *b)
+{
+   return strcmp(((const RankEntry *) a)->dir, ((const RankEntry *) b)->dir);
+}
+
+int CompareRankPrio(const void *a, const void *b)
+{
+   const RankEntry *r1 = (const RankEntry *) a;
+   const RankEntry *r2 = (const RankEntry *) b;
+
+   if (r1->prio != r2->prio) return (r1->prio > r2->prio) ? -1 : 1;
+   return r1->index - r2->index;
+}
+
+/***************************************************************/
+/*                                                             */
+/*  SortRanked                                                 */
+/*                                                             */
+/*  Sort the components of a path variable by priority, and    */
+/*  issue the commands to set it and its priority list.        */
+/*  Components without a priority count as 0.  Entries for     */
+/*  directories no longer on the path are dropped.             */
+/*                                                             */
+/***************************************************************/
+void SortRanked(const char *var, int shell)
+{
+   RankEntry meta[MAXCOMPONENTS];
+   RankEntry comp[MAXCOMPONENTS];
+   RankEntry key, *found;
+   int nmeta = 0;
+   int i, len;
+   char *rankvar, *metastr, *path, *newval, *s, *t, *e;
+
+   /* Read the priorities, sorted by directory for lookup */
+   rankvar = RankVarName(var);
+   metastr = GetVar(rankvar);
+   metastr = strdup(metastr ? metastr : "");
+   if (!metastr) {
+      fprintf(stderr, "%s: out of memory!\n", Argv[0]);
+      exit(1);
+   }
+   for (s = metastr; s && nmeta < MAXCOMPONENTS; s = t) {
+      t = strchr(s, ':');
+      if (t) *t++ = 0;
+      e = strchr(s, '=');
+      if (!e) continue;
+      *e = 0;
+      meta[nmeta].dir = NormalizeDir(e+1);
+      meta[nmeta].prio = atoi(s);
+      meta[nmeta].index = nmeta;
+      nmeta++;
+   }
+   qsort(meta, nmeta, sizeof(RankEntry), CompareRankDir);
+
+   /* Give each component its priority */
+   path = GetVar(var);
+   path = strdup(path ? path : "");
+   if (!path) {
+      fprintf(stderr, "%s: out of memory!\n", Argv[0]);
+      exit(1);
+   }
+   (void) SplitPath(path);
+   len = 1;
+   for (i=0; i<NumComponents; i++) {
+      key.dir = NormalizeDir(PathComp[i]);
+      found = bsearch(&key, meta, nmeta, sizeof(RankEntry), CompareRankDir);
+      free(key.dir);
+      comp[i].dir = PathComp[i];
+      comp[i].prio = found ? found->prio : 0;
+      comp[i].index = found ? (int) (found - meta) : -1;
+      len += strlen(PathComp[i]) + 24;
+   }
+
+   /* Remember which priorities are still in use, then do the sort */
+   for (i=0; i<nmeta; i++) meta[i].index = 0;
+   for (i=0; i<NumComponents; i++) {
+      if (comp[i].index >= 0) meta[comp[i].index].index = 1;
+      comp[i].index = i;
+   }
+   qsort(comp, NumComponents, sizeof(RankEntry), CompareRankPrio);
+
+   newval = malloc(len);
+   if (!newval) {
+      fprintf(stderr, "%s: out of memory!\n", Argv[0]);
+      exit(1);
+   }
+
+   s = newval;
+   *s = 0;
+   for (i=0; i<NumComponents; i++) {
+      sprintf(s, "%s%s", i ? ":" : "", comp[i].dir);
+      s += strlen(s);
+   }
+   DoSetenv(var, newval, shell, 0);
+
+   s = newval;
+   *s = 0;
+   for (i=0; i<nmeta; i++) {
+      if (meta[i].index) {
+	 sprintf(s, "%s%d=%s", (s > newval) ? ":" : "", meta[i].prio, meta[i].dir);
+	 s += strlen(s);
+      }
+   }
+   DoSetenv(rankvar, newval, shell, 0);
+
+   for (i=0; i<nmeta; i++) free(meta[i].dir);
+   free(newval);
+   free(path);
+   free(metastr);
+   free(rankvar);
+}
+
+/***************************************************************/
+/*                                                             */
+/*  EmitRanked                                                 */
+/*                                                             */
+/*  Sort and issue each variable touched by "rank" this run.   */
+/*                                                             */
+/***************************************************************/
+void EmitRanked(int shell)
+{
+   int i;
+
+   for (i=0; i<NumRanked; i++) {
+      SortRanked(Ranked[i], shell);
+      free(Ranked[i]);
+   }
+   NumRanked = 0;
+}
+
+/***************************************************************/
+/*                                                             */
+/*  DoChoose                                                   */
+/*                                                             */
+/*  Simple-minded:  If shell is 0, print val1, else print val2 */
+/*                                                             */
+/***************************************************************/
+void DoChoose(const char *val1, const char *val2, int shell)
+{
+   switch(shell) {
+      case SH_LIKE:
+         PrintEscaped(val1, 0);
+	 Emit(TrailingSemi);
+	 break;
+
+     case CSH_LIKE:
+	 PrintEscaped(val2, 0);
+	 Emit(TrailingSemi);
+	 break;
+
+     default:
+	 fprintf(stderr, "%s: DoChoose - bad value for shell %d\n", Argv[0], shell);
+	 break;
+   }
+}
+
+
+/***************************************************************/
+/*                                                             */
+/*  InitLoaded                                                 */
+/*                                                             */
+/*  Seed the list of loaded packages from ENVV_LOADED.         */
+/*                                                             */
+/***************************************************************/
+void InitLoaded(void)
+{
+   char *list, *s, *t;
+
+   if (LoadedInit) return;
+   LoadedInit = 1;
+
+   list = GetVar(LOADED_VAR);
+   if (!list) return;
+   list = strdup(list);
+   if (!list) {
+      fprintf(stderr, "%s: out of memory!\n", Argv[0]);
+      exit(1);
+   }
+
+   for (s = list; s; s = t) {
+      t = strchr(s, ':');
+      if (t) *t++ = 0;
+      if (*s && NumLoaded < MAXPACKAGES) {
+	 Loaded[NumLoaded] = strdup(s);
+	 if (!Loaded[NumLoaded]) {
+	    fprintf(stderr, "%s: out of memory!\n", Argv[0]);
+	    exit(1);
+	 }
+	 NumLoaded++;
+      }
+   }
+   free(list);
+}
+
+/***************************************************************/
+/*                                                             */
+/*  IsLoaded                                                   */
+/*                                                             */
+/*  Return 1 if the named package has already been loaded.     */
+/*                                                             */
+/***************************************************************/
+int IsLoaded(const char *name)
+{
+   int i;
+
+   InitLoaded();
+   for (i=0; i<NumLoaded; i++)
+     if (!strcmp(name, Loaded[i])) return 1;
+
+   return 0;
+}
+
+/***************************************************************/
+/*                                                             */
+/*  MarkLoaded                                                 */
+/*                                                             */
+/*  Add a package to the list of loaded packages.              */
+/*                                                             */
+/***************************************************************/
+void MarkLoaded(const char *name)
+{
+   if (IsLoaded(name)) return;
+   if (NumLoaded == MAXPACKAGES) {
+      fprintf(stderr, "%s: too many packages loaded\n", Argv[0]);
+      return;
+   }
+   Loaded[NumLoaded] = strdup(name);
+   if (!Loaded[NumLoaded]) {
+      fprintf(stderr, "%s: out of memory!\n", Argv[0]);
+      exit(1);
+   }
+   NumLoaded++;
+   LoadedChanged = 1;
+}
+
+/***************************************************************/
+/*                                                             */
+/*  EmitLoaded                                                 */
+/*                                                             */
+/*  If any packages were loaded by this run, issue the command */
+/*  to record them all in ENVV_LOADED.                         */
+/*                                                             */
+/***************************************************************/
+void EmitLoaded(int shell)
+{
+   int i, len;
+   char *list;
+
+   if (!LoadedChanged) return;
+
+   len = 1;
+   for (i=0; i<NumLoaded; i++) len += strlen(Loaded[i]) + 1;
+   list = malloc(len);
+   if (!list) {
+      fprintf(stderr, "%s: out of memory!\n", Argv[0]);
+      exit(1);
+   }
+
+   *list = 0;
+   for (i=0; i<NumLoaded; i++) {
+      if (i) strcat(list, ":");
+      strcat(list, Loaded[i]);
+   }
+   DoSetenv(LOADED_VAR, list, shell, 0);
+   free(list);
+   LoadedChanged = 0;
+}
+
+/***************************************************************/
+/*                                                             */
+/*  FindPackage                                                */
+/*                                                             */
+/*  Find the file holding a package's directives.  Names with  */
+/*  a '/' are taken as file names; others are looked up in the */
+/*  directories listed in ENVV_PATH.  Returns a malloc'd       */
+/*  string, or NULL if the package can't be found.             */
+/*                                                             */
+/***************************************************************/
+char *FindPackage(const char *name)
+{
+   char *path, *dir, *t, *file;
+
+   if (strchr(name, '/')) {
+      if (access(name, R_OK)) return NULL;
+      return strdup(name);
+   }
+
+   path = GetVar(PACKAGE_PATH_VAR);
+   if (!path) return NULL;
+   path = strdup(path);
+   if (!path) return NULL;
+
+   for (dir = path; dir; dir = t) {
+      t = strchr(dir, ':');
+      if (t) *t++ = 0;
+      if (!*dir) continue;
+      file = malloc(strlen(dir) + strlen(name) + 2);
+      if (!file) break;
+      sprintf(file, "%s/%s", dir, name);
+      if (!access(file, R_OK)) {
+	 free(path);
+	 return file;
+      }
+      free(file);
+   }
+   free(path);
+   return NULL;
+}
+
+/***************************************************************/
+/*                                                             */
+/*  LoadPackage                                                */
+/*                                                             */
+/*  Apply the directives in a package file, after first        */
+/*  loading every package it requires.  Packages which are     */
+/*  already loaded are skipped.  Return 0 for success, -1 if   */
+/*  the package or one of its dependencies can't be loaded.    */
+/*                                                             */
+/***************************************************************/
+int LoadPackage(const char *name, int shell)
+{
+   FILE *fp;
+   FILE *saved;
+   char *file;
+   int i;
+   int failed;
+
+   if (IsLoaded(name)) return 0;
+
+   if (strchr(name, ':')) {
+      fprintf(stderr, "%s: bad package name %s\n", Argv[0], name);
+      return -1;
+   }
+
+   /* Is it already being loaded?  Then we have a cycle. */
+   for (i=0; i<LoadDepth; i++) {
+      if (!strcmp(name, Loading[i])) {
+	 fprintf(stderr, "%s: dependency cycle:", Argv[0]);
+	 for (; i<LoadDepth; i++) fprintf(stderr, " %s ->", Loading[i]);
+	 fprintf(stderr, " %s\n", name);
+	 return -1;
+      }
+   }
+   if (LoadDepth == MAX_REQUIRE_DEPTH) {
+      fprintf(stderr, "%s: packages nested too deeply at %s\n", Argv[0], name);
+      return -1;
+   }
+
+   file = FindPackage(name);
+   if (!file) {
+      fprintf(stderr, "%s: can't find package %s\n", Argv[0], name);
+      return -1;
+   }
+   fp = fopen(file, "r");
+   if (!fp) {
+      fprintf(stderr, "%s: can't read package file %s\n", Argv[0], file);
+      free(file);
+      return -1;
+   }
+   free(file);
+
+   /* Keep our own copy of the name -- Var gets overwritten as we read */
+   Loading[LoadDepth] = strdup(name);
+   if (!Loading[LoadDepth]) {
+      fprintf(stderr, "%s: out of memory!\n", Argv[0]);
+      exit(1);
+   }
+   LoadDepth++;
+   saved = Input;
+   Input = fp;
+
+   /* First pass: load dependencies, so they are applied before
+      anything in this package regardless of where the "require"
+      lines appear. */
+   failed = 0;
+   while (ReadCmdFromStdin()) {
+      if (!strcasecmp(Directive, "require") && DoDirective(shell)) failed = 1;
+   }
+
+   /* Second pass: everything else, unless a dependency is missing.
+      In that case the package isn't recorded as loaded either, so a
+      later require can try again. */
+   if (!failed) {
+      rewind(fp);
+      while (ReadCmdFromStdin()) {
+	 if (!strcasecmp(Directive, "require")) continue;
+	 (void) DoDirective(shell);
+      }
+   }
+
+   Input = saved;
+   fclose(fp);
+   LoadDepth--;
+   if (failed) {
+      fprintf(stderr, "%s: package %s not loaded: a dependency failed\n",
+	      Argv[0], Loading[LoadDepth]);
+   } else {
+      MarkLoaded(Loading[LoadDepth]);
+   }
+   free(Loading[LoadDepth]);
+   return failed ? -1 : 0;
+}
+
+/***************************************************************/
+/*                                                             */
+/*  DeferVar                                                   */
+/*                                                             */
+/*  Note that var was changed inside a package.  Returns 0 if  */
+/*  the list is full, in which case the caller issues the      */
+/*  command right away.                                        */
+/*                                                             */
+/***************************************************************/
+int DeferVar(const char *var, int local)
+{
+   int i;
+
+   for (i=0; i<NumPending; i++) {
+      if (!strcmp(var, Pending[i].var)) {
+	 Pending[i].local = local;
+	 return 1;
+      }
+   }
+   if (NumPending == MAXPENDING) return 0;
+   Pending[NumPending].var = strdup(var);
+   if (!Pending[NumPending].var) {
+      fprintf(stderr, "%s: out of memory!\n", Argv[0]);
+      exit(1);
+   }
+   Pending[NumPending].local = local;
+   NumPending++;
+   return 1;
+}
+
+/***************************************************************/
+/*                                                             */
+/*  FlushPending                                               */
+/*                                                             */
+/*  Issue each variable changed by the packages just loaded,   */
+/*  once, with its final value.  Ranked variables are left to  */
+/*  EmitRanked.                                                */
+/*                                                             */
+/***************************************************************/
+void FlushPending(int shell)
+{
+   int i;
+   char *val;
+
+   for (i=0; i<NumPending; i++) {
+      if (!IsRanked(Pending[i].var)) {
+	 val = GetVar(Pending[i].var);
+	 DoSetenv(Pending[i].var, val ? val : "", shell, Pending[i].local);
+      }
+      free(Pending[i].var);
+   }
+   NumPending = 0;
+}
+
+/***************************************************************/
+/*                                                             */
+/*  TraceNow                                                   */
+/*                                                             */
+/*  Return the wall-clock time in microseconds.  Wall-clock    */
+/*  time lets events from different processes be lined up.     */
+/*                                                             */
+/***************************************************************/
+long long TraceNow(void)
+{
+   struct timespec ts;
+
+   if (clock_gettime(CLOCK_REALTIME, &ts)) return 0;
+   return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/***************************************************************/
+/*                                                             */
+/*  Trace                                                      */
+/*                                                             */
+/*  Append one event to the trace file.  Each line is:         */
+/*  time-in-usec TAB pid TAB event [TAB args...]               */
+/*  String args must be passed through TraceEscape first.      */
+/*                                                             */
+/***************************************************************/
+void Trace(long long ts, const char *fmt, ...)
+{
+   char buf[MAX_TRACE_LEN];
+   va_list ap;
+   int n, m;
+
+   if (TraceFd < 0) return;
+
+   n = snprintf(buf, sizeof(buf), "%lld\t%ld\t", ts, (long) getpid());
+   va_start(ap, fmt);
+   m = vsnprintf(buf+n, sizeof(buf)-n-1, fmt, ap);
+   va_end(ap);
+   if (m < 0) return;
+   n += m;
+   if (n > (int) sizeof(buf) - 2) n = sizeof(buf) - 2;
+   buf[n++] = '\n';
+
+   /* One write, so the line can't be interleaved with another process */
+   (void) write(TraceFd, buf, n);
+}
+
+/***************************************************************/
+/*                                                             */
+/*  TraceEscape                                                */
+/*                                                             */
+/*  Copy s into buf so that it can't break up a trace line:    */
+/*  backslash, tab, newline and CR become \\, \t, \n and \r,   */
+/*  and other control chars become \xHH.  Truncates to fit.    */
+/*                                                             */
+/***************************************************************/
+char *TraceEscape(const char *s, char *buf, int len)
+{
+   char *t = buf;
+   char esc;
+
+   if (!s) s = "";
+   while (*s && t - buf < len - 5) {
+      esc = 0;
+      switch (*s) {
+       case '\\': esc = '\\'; break;
+       case '\t': esc = 't';  break;
+       case '\n': esc = 'n';  break;
+       case '\r': esc = 'r';  break;
+      }
+      if (esc) {
+	 *t++ = '\\';
+	 *t++ = esc;
+      } else if ((unsigned char) *s < 0x20 || *s == 0x7f) {
+	 sprintf(t, "\\x%02x", (unsigned char) *s);
+	 t += 4;
+      } else {
+	 *t++ = *s;
+      }
+      s++;
+   }
+   *t = 0;
+   return buf;
+}
+
+/***************************************************************/
+/*                                                             */
+/*  InitTrace                                                  */
+/*                                                             */
+/*  If ENVV_TRACE is set, open the trace file and log startup. */
+/*                                                             */
+/***************************************************************/
+void InitTrace(void)
+{
+   char *file;
+   char args[MAX_TRACE_LEN/2];
+   char targs[MAX_TRACE_LEN/2];
+   int i, n;
+
+   file = GetVar(TRACE_VAR);
+   if (!file || !*file) return;
+
+   TraceFd = open(file, O_WRONLY | O_APPEND | O_CREAT, 0666);
+   if (TraceFd < 0) return;
+
+   /* Log the arguments so invocations can be told apart */
+   n = 0;
+   args[0] = 0;
+   for (i=1; i<Argc && n < (int) sizeof(args) - 1; i++)
+     n += snprintf(args+n, sizeof(args)-n, "%s%s", (i > 1) ? " " : "", Argv[i]);
+
+   Trace(TraceNow(), "start\t%s\t%s", UseCmdLine ? "cmdline" : "stdin",
+	 TraceEscape(args, targs, sizeof(targs)));
+}
+
+/***************************************************************/
+/*                                                             */
+/*  TraceExit                                                  */
+/*                                                             */
+/*  Log the number of bytes emitted as envv exits.             */
+/*                                                             */
+/***************************************************************/
+void TraceExit(void)
+{
+   if (TraceFd < 0) return;
+   Trace(TraceNow(), "exit\t%ld", BytesEmitted);
+   close(TraceFd);
+   TraceFd = -1;
+}
+
+/***************************************************************/
+/*                                                             */
+/*  Usage - print usage instructions                           */
+/*                                                             */
+/***************************************************************/
+void Usage(const char *name)
+{
+   fprintf(stderr, "%s (version %s) Copyright 1994-2011 by Roaring Penguin Software Inc.\n\n",
 	   name, VERSION);
    fprintf(stderr, "Usage:\n");
    fprintf(stderr, "   %s [options] set var value\n", name);
@@ -637,31 +1910,40 @@ void Usage(const char *name)
    fprintf(stderr, "   %s [options] move pathvar dir pos\n", name);
    fprintf(stderr, "   %s [options] del pathvar dir\n", name);
    fprintf(stderr, "   %s [options] choose sh_choice csh_choice\n", name);
+   fprintf(stderr, "   %s [options] require package\n", name);
+   fprintf(stderr, "   %s [options] addifdir pathvar dir [pos]\n", name);
+   fprintf(stderr, "   %s [options] setiffile var file\n", name);
+   fprintf(stderr, "   %s [options] setifunset var value\n", name);
+   fprintf(stderr, "   %s [options] rank pathvar dir priority\n", name);
    fprintf(stderr, "\nOptions:\n");
    fprintf(stderr, "   -e = Do not escape shell meta-characters\n");
    fprintf(stderr, "   -s = Put trailing semicolon after each command\n");
+   fprintf(stderr, "   -a = Edit zsh/csh path arrays, not whole path variables\n");
    fprintf(stderr, "   -h = Display usage information\n");
    fprintf(stderr, "\nIf no directives are given on command line, they\n");
    fprintf(stderr, "are read from stdin.  Multiple directives may be\n");
    fprintf(stderr, "issued this way.\n");
-   exit(1);
 }
 
 /***************************************************************/
 /*                                                             */
 /* Init                                                        */
 /*                                                             */
-/* Read command-line args and options.                         */
+/* Read command-line args and options.  Return non-zero if     */
+/* envv should stop right away.                                */
 /*                                                             */
 /***************************************************************/
-void Init(int argc, char *argv[])
+int Init(int argc, char *argv[])
 {
    int i;
    char *s;
 
+   ResetState();
+
    /* Set global vars */
    Argc = argc;
    Argv = argv;
+   Input = stdin;
 
    /* Get the options */
    for (i=1; i<argc; i++) {
@@ -677,13 +1959,18 @@ void Init(int argc, char *argv[])
 	  case 'h':
 	  case 'H':
 	    Usage(argv[0]);
-	    exit(1);
+	    return 1;
 
 	  case 's':
 	  case 'S':
 	    TrailingSemi = " ;\n";
 	    break;
 
+	  case 'a':
+	  case 'A':
+	    UseArrays = 1;
+	    break;
+
 	  default:
 	    fprintf(stderr, "%s: Unknown option '%c'\n", argv[0], *s);
 	    break;
@@ -696,6 +1983,46 @@ void Init(int argc, char *argv[])
    FirstArg = i;
    if (FirstArg < argc) UseCmdLine = 1;
    else UseCmdLine = 0;
+
+   InitTrace();
+   return 0;
+}
+
+/***************************************************************/
+/*                                                             */
+/* ResetState                                                  */
+/*                                                             */
+/* Forget everything left over from a previous run, which only */
+/* happens when envv is a shell builtin.                       */
+/*                                                             */
+/***************************************************************/
+void ResetState(void)
+{
+   int i;
+
+   ShouldEscape = 1;
+   TrailingSemi = "\n";
+   UseArrays = 0;
+   ShellArrays = NO_ARRAYS;
+   BytesEmitted = 0;
+
+   for (i=0; i<NumExpandCache; i++) free(ExpandCache[i].name);
+   NumExpandCache = 0;
+
+   for (i=0; i<NumStatCache; i++) free(StatCache[i].path);
+   NumStatCache = 0;
+
+   for (i=0; i<NumLoaded; i++) free(Loaded[i]);
+   NumLoaded = 0;
+   LoadedInit = 0;
+   LoadedChanged = 0;
+   LoadDepth = 0;
+
+   for (i=0; i<NumRanked; i++) free(Ranked[i]);
+   NumRanked = 0;
+
+   for (i=0; i<NumPending; i++) free(Pending[i].var);
+   NumPending = 0;
 }
 
 /***************************************************************/
@@ -749,8 +2076,12 @@ int GetCommand(void)
 /***************************************************************/
 int ReadCmdFromStdin(void)
 {
-   /* Try reading the directive first */
-   if (!ReadEscapedToken(Directive, MAX_DIR_LEN, 0)) return 0;
+   /* Try reading the directive first, skipping comment lines */
+   while (1) {
+      if (!ReadEscapedToken(Directive, MAX_DIR_LEN, 0)) return 0;
+      if (*Directive != '#') break;
+      while (ReadEscapedToken(Pos, MAX_POS_LEN, 1)) continue;
+   }
 
    ArgsSupplied = 1;
 
@@ -769,7 +2100,7 @@ int ReadCmdFromStdin(void)
 /*                                                             */
 /* ReadEscapedToken                                            */
 /*                                                             */
-/* Read a token from stdin.                                    */
+/* Read a token from the current input (stdin or a package).   */
 /*                                                             */
 /***************************************************************/
 int ReadEscapedToken(char *buf, int len, int eoln_flag)
@@ -784,36 +2115,36 @@ int ReadEscapedToken(char *buf, int len, int eoln_flag)
    if (seen_eoln) return 0;
 
 /* Skip whitespace */
-   ch = getchar();
+   ch = getc(Input);
    if (ch == EOF) return 0;
    while (isspace(ch)) {
       if (ch == '\n' && eoln_flag) {
 	 seen_eoln = 1;
 	 return 0;
       }
-      ch = getchar();
+      ch = getc(Input);
    }
 
 /* Read 'len' escaped chars */
    while (nread < len) {
       if (ch == EOF) return 0; /* EOF reached */
       if (ch == '\\') {
-	 ch = getchar();
+	 ch = getc(Input);
 	 if (ch == EOF) return 0;
 	 *buf++ = ch;
 	 nread++;
-	 ch = getchar();
+	 ch = getc(Input);
 	 continue;
       } else if (isspace(ch)) break;
       else {
 	 *buf++ = ch;
 	 nread++;
-	 ch = getchar();
+	 ch = getc(Input);
       }
    }
 
 /* If we didn't halt because of whitespace, skip to next whitespace */
-   while (ch != EOF && !isspace(ch)) ch = getchar();
+   while (ch != EOF && !isspace(ch)) ch = getc(Input);
 
    if (ch == '\n') seen_eoln = 1;
    *buf = 0;
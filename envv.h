@@ -0,0 +1,35 @@
+/***************************************************************/
+/*                                                             */
+/*  ENVV.H                                                     */
+/*                                                             */
+/*  Interface between envv's directive engine (envv.c) and     */
+/*  the bash and zsh builtins which run it inside the shell.   */
+/*                                                             */
+/*  Copyright (C) 1994-2011 by Roaring Penguin Software Inc.   */
+/*  http://www.roaringpenguin.com                              */
+/*  dfs@roaringpenguin.com                                     */
+/*                                                             */
+/***************************************************************/
+#ifndef ENVV_H
+#define ENVV_H
+
+/* Possible types of shells */
+#define NO_SH    -1
+#define SH_LIKE  0
+#define CSH_LIKE 1
+
+/* When envv runs as a shell builtin, it reads and sets the shell's
+   variables through these hooks instead of the environment, and does
+   not print any shell commands. */
+typedef struct {
+   int shell;			/* Type of the shell we're built into */
+   char *(*getvar)(const char *var);
+   void (*setvar)(const char *var, const char *val, int local);
+} EnvvHooks;
+
+extern EnvvHooks *ShellHooks;
+
+/* Run envv with the given arguments; returns the exit status */
+int RunEnvv (int argc, char *argv[]);
+
+#endif
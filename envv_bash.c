@@ -0,0 +1,106 @@
+/***************************************************************/
+/*                                                             */
+/*  ENVV_BASH.C                                                */
+/*                                                             */
+/*  envv as a bash loadable builtin.  Directives are applied   */
+/*  directly to the shell's variables, so there is no fork,    */
+/*  pipe or eval:                                              */
+/*                                                             */
+/*  enable -f /path/to/envv.so envv                            */
+/*  envv add PATH /usr/local/foobar/bin                        */
+/*                                                             */
+/*  Copyright (C) 1994-2011 by Roaring Penguin Software Inc.   */
+/*  http://www.roaringpenguin.com                              */
+/*  dfs@roaringpenguin.com                                     */
+/*                                                             */
+/***************************************************************/
+#include <config.h>
+
+#if defined (HAVE_UNISTD_H)
+#  include <unistd.h>
+#endif
+
+#include <stdio.h>
+
+#include "builtins.h"
+#include "shell.h"
+#include "common.h"
+
+#include "envv.h"
+
+/***************************************************************/
+/*                                                             */
+/*  BashGetVar                                                 */
+/*                                                             */
+/*  Get the value of a shell variable.                         */
+/*                                                             */
+/***************************************************************/
+static char *BashGetVar(const char *var)
+{
+   return get_string_value(var);
+}
+
+/***************************************************************/
+/*                                                             */
+/*  BashSetVar                                                 */
+/*                                                             */
+/*  Set a shell variable, exporting it unless it is local.     */
+/*                                                             */
+/***************************************************************/
+static void BashSetVar(const char *var, const char *val, int local)
+{
+   SHELL_VAR *v;
+
+   v = bind_variable(var, (char *) val, 0);
+   if (!v || readonly_p(v)) return;
+
+   if (!local) set_auto_export(v);
+
+   /* Let bash react to PATH, MAILPATH, etc. changing */
+   stupidly_hack_special_variables((char *) var);
+}
+
+static EnvvHooks BashHooks = { SH_LIKE, BashGetVar, BashSetVar };
+
+/***************************************************************/
+/*                                                             */
+/*  envv_builtin                                               */
+/*                                                             */
+/*  The builtin itself: run envv with the shell's hooks.       */
+/*                                                             */
+/***************************************************************/
+int envv_builtin(WORD_LIST *list)
+{
+   char **argv;
+   int argc;
+   int status;
+
+   argv = strvec_from_word_list(list, 0, 1, &argc);
+   argv[0] = "envv";
+
+   ShellHooks = &BashHooks;
+   status = RunEnvv(argc, argv);
+   ShellHooks = NULL;
+
+   xfree(argv);
+   return status ? EXECUTION_FAILURE : EXECUTION_SUCCESS;
+}
+
+char *envv_doc[] = {
+   "Manipulate environment variables.",
+   "",
+   "Apply envv directives directly to the shell's variables, instead of",
+   "running the envv program and evaluating its output.  The options and",
+   "directives are the same as for envv(1), except that -a has no effect.",
+   "With no directives, they are read from standard input.",
+   (char *) NULL
+};
+
+struct builtin envv_struct = {
+   "envv",
+   envv_builtin,
+   BUILTIN_ENABLED,
+   envv_doc,
+   "envv [options] [directive args ...]",
+   0
+};
@@ -0,0 +1,14 @@
+/***************************************************************/
+/*                                                             */
+/*  ENVV_ENGINE.C                                              */
+/*                                                             */
+/*  envv's directive engine without main(), for linking into   */
+/*  the bash and zsh builtins.                                 */
+/*                                                             */
+/*  Copyright (C) 1994-2011 by Roaring Penguin Software Inc.   */
+/*  http://www.roaringpenguin.com                              */
+/*  dfs@roaringpenguin.com                                     */
+/*                                                             */
+/***************************************************************/
+#define ENVV_BUILTIN 1
+#include "envv.c"
@@ -0,0 +1,145 @@
+/***************************************************************/
+/*                                                             */
+/*  ENVV_ZSH.C                                                 */
+/*                                                             */
+/*  envv as a zsh module providing an "envv" builtin.          */
+/*  Directives are applied directly to the shell's parameters, */
+/*  so there is no fork, pipe or eval:                         */
+/*                                                             */
+/*  zmodload zsh/envv                                          */
+/*  envv add PATH /usr/local/foobar/bin                        */
+/*                                                             */
+/*  Copyright (C) 1994-2011 by Roaring Penguin Software Inc.   */
+/*  http://www.roaringpenguin.com                              */
+/*  dfs@roaringpenguin.com                                     */
+/*                                                             */
+/***************************************************************/
+#include "envv.mdh"
+#include "envv_zsh.pro"
+
+#include "envv.h"
+
+/***************************************************************/
+/*                                                             */
+/*  ZshGetVar                                                  */
+/*                                                             */
+/*  Get the value of a shell parameter, unmetafied.  The copy  */
+/*  lives on the heap until the builtin returns.               */
+/*                                                             */
+/***************************************************************/
+static char *ZshGetVar(const char *var)
+{
+   char *val;
+
+   val = getsparam((char *) var);
+   if (!val) return NULL;
+   val = dupstring(val);
+   unmetafy(val, NULL);
+   return val;
+}
+
+/***************************************************************/
+/*                                                             */
+/*  ZshSetVar                                                  */
+/*                                                             */
+/*  Set a shell parameter, exporting it unless it is local.    */
+/*                                                             */
+/***************************************************************/
+static void ZshSetVar(const char *var, const char *val, int local)
+{
+   Param pm;
+
+   pm = setsparam(dupstring(var), ztrdup_metafy(val));
+   if (!pm || local) return;
+
+   if (!(pm->node.flags & PM_EXPORTED)) {
+      pm->node.flags |= PM_EXPORTED;
+      export_param(pm);
+   }
+}
+
+static EnvvHooks ZshHooks = { SH_LIKE, ZshGetVar, ZshSetVar };
+
+/***************************************************************/
+/*                                                             */
+/*  bin_envv                                                   */
+/*                                                             */
+/*  The builtin itself: run envv with the shell's hooks.       */
+/*                                                             */
+/***************************************************************/
+static int bin_envv(char *nam, char **args, UNUSED(Options ops), UNUSED(int func))
+{
+   char **argv;
+   int argc, i;
+   int status;
+
+   argc = arrlen(args) + 1;
+   argv = (char **) zhalloc((argc + 1) * sizeof(char *));
+   argv[0] = nam;
+   for (i=1; i<argc; i++) {
+      argv[i] = dupstring(args[i-1]);
+      unmetafy(argv[i], NULL);
+   }
+   argv[argc] = NULL;
+
+   ShellHooks = &ZshHooks;
+   status = RunEnvv(argc, argv);
+   ShellHooks = NULL;
+
+   return status;
+}
+
+static struct builtin bintab[] = {
+   BUILTIN("envv", 0, bin_envv, 0, -1, 0, NULL, NULL),
+};
+
+static struct features module_features = {
+   bintab, sizeof(bintab)/sizeof(*bintab),
+   NULL, 0,
+   NULL, 0,
+   NULL, 0,
+   0
+};
+
+/**/
+int
+setup_(UNUSED(Module m))
+{
+   return 0;
+}
+
+/**/
+int
+features_(Module m, char ***features)
+{
+   *features = featuresarray(m, &module_features);
+   return 0;
+}
+
+/**/
+int
+enables_(Module m, int **enables)
+{
+   return handlefeatures(m, &module_features, enables);
+}
+
+/**/
+int
+boot_(UNUSED(Module m))
+{
+   return 0;
+}
+
+/**/
+int
+cleanup_(Module m)
+{
+   return setfeatureenables(m, &module_features, NULL);
+}
+
+/**/
+int
+finish_(UNUSED(Module m))
+{
+   return 0;
+}